@@ -5,27 +5,18 @@
 #include <linux/miscdevice.h>
 
 #include <linux/fs.h>
+#include <linux/device.h>
 #include <linux/stat.h>
 #include <linux/slab.h>    
 
 #include <linux/uaccess.h>
 
 #include <linux/sched.h>
-#include <linux/mutex.h>
+#include <linux/rtmutex.h>
 
 #include <linux/string.h>
 
-
-#define LEFTPAD_DEVICE_NAME "leftpad"
-#define LEFTPAD_MAJOR 1337
-
-#define IOCTL_SET_WIDTH _IOR(LEFTPAD_MAJOR, 0, char *)
-#define IOCTL_SET_FILL _IOR(LEFTPAD_MAJOR, 1, char *)
-
-#define MAX_WIDTH 1024
-
-#define SUCCESS 0
-#define FAILURE -1
+#include "leftpad_engine.h"
 
 
 MODULE_LICENSE("GPL");
@@ -40,148 +31,167 @@ MODULE_SUPPORTED_DEVICE(LEFTPAD_DEVICE_NAME);
 static int width = 32;
 static int fill = 32;
 static int buffer_size = 1024;
+static int mode = 0;
+static int stages = 0;
+static int minors = 4;
 
-module_param(width, int, S_IRUGO | S_IWUSR);
-MODULE_PARM_DESC(width, "Lines are padded so that their width (not including EOL) is the residue class modulo MAX_WIDTH of the value of this parameter.");
-module_param(fill, int, S_IRUGO | S_IWUSR);
-MODULE_PARM_DESC(fill, "The residue class modulo 256 of the value of this parameter is used to pad lines shorter than width.");
-module_param(buffer_size, int, S_IRUGO | S_IWUSR);
-MODULE_PARM_DESC(buffer_size, "Size of internal ring buffer.");
-
-
-static size_t get_width(void)
+static int stages_set(const char *val, const struct kernel_param *kp)
 {
-    return width % MAX_WIDTH;
-}
+    int new_stages;
 
-static char get_fill(void)
-{
-    return fill % 128;
+    if (kstrtoint(val, 0, &new_stages) || new_stages < 0 || !stages_valid(new_stages)) {
+        return -EINVAL;
+    }
+    *(int *) kp->arg = new_stages;
+    return SUCCESS;
 }
 
-static size_t get_buffer_size(void)
+static int stages_get(char *buffer, const struct kernel_param *kp)
 {
-    return buffer_size;
+    return sprintf(buffer, "%#x", *(int *) kp->arg);
 }
 
+static const struct kernel_param_ops stages_ops = {
+    .set = stages_set,
+    .get = stages_get
+};
 
-/* STATE */
+module_param(width, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(width, "Lines are padded so that their width (not including EOL) is the residue class modulo MAX_WIDTH of the value of this parameter.");
+module_param(fill, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(fill, "The residue class modulo 256 of the value of this parameter is used to pad lines shorter than width.");
+module_param(buffer_size, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(buffer_size, "Size of internal ring buffer.");
+module_param(mode, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mode, "Mode flags: 1 = deterministic (preallocated, bounded critical sections), 2 = batch (reads return as many whole short lines as fit).");
+module_param_cb(stages, &stages_ops, &stages, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(stages, "Per-line stage chain, as for IOCTL_SET_STAGES (e.g. 0x4321 = trim, expand tabs, pad, truncate).");
+module_param(minors, int, S_IRUGO);
+MODULE_PARM_DESC(minors, "Number of minors (starting at 0) with their own preset under /sys/class/leftpad.");
 
 
-struct newline {
-    size_t ix;
-    struct newline *prev, *next;
-};
+/* PRESETS */
 
-struct buffer {
-    wait_queue_head_t read_queue;
-    struct mutex lock;
 
-    size_t size, width;
-    char fill;
+/* Per-minor overrides of the module parameters. A value of -1 means the
+ * corresponding module parameter is used. Minors without a preset use the
+ * module parameters directly.
+ */
+struct preset {
+    int width, fill, buffer_size, mode, stages;
+};
 
-    char *start;
-    size_t cursor, length;
+static struct preset *presets;
 
-    ssize_t padding_left;
-    struct newline *head, *tail;
-};
+static struct preset *get_preset(struct inode *inode)
+{
+    unsigned int minor = iminor(inode);
+    return minor < minors ? &presets[minor] : NULL;
+}
 
-static int append_newline(size_t ix, struct buffer *buf)
+static size_t get_width(const struct preset *preset)
 {
-    struct newline *nl = kmalloc(sizeof(*nl), GFP_KERNEL);
-    if (unlikely(!nl)) {
-        return FAILURE;
-    }
-    nl->ix = ix;
-    nl->prev = buf->tail->prev;
-    nl->next = buf->tail;
-    buf->tail->prev->next = nl;
-    buf->tail->prev = nl;
-    return SUCCESS;
+    return (preset && preset->width >= 0 ? preset->width : width) % MAX_WIDTH;
 }
 
-static struct buffer *buffer_alloc(size_t size, size_t width, char fill)
+static char get_fill(const struct preset *preset)
 {
-    struct buffer *buf = kmalloc(sizeof(*buf), GFP_KERNEL);
-    if (unlikely(!buf)) {
-        return NULL;
-    }
+    return (preset && preset->fill >= 0 ? preset->fill : fill) % 128;
+}
 
-    buf->start = kmalloc(size, GFP_KERNEL);
-    if (unlikely(!buf->start)) {
-        kfree(buf);
-        return NULL;
-    }
+static size_t get_buffer_size(const struct preset *preset)
+{
+    return preset && preset->buffer_size >= 0 ? preset->buffer_size : buffer_size;
+}
 
-    init_waitqueue_head(&buf->read_queue);
-    mutex_init(&buf->lock);
+static int get_mode(const struct preset *preset)
+{
+    return (preset && preset->mode >= 0 ? preset->mode : mode) & LEFTPAD_MODES;
+}
 
-    buf->size = size;
-    buf->width = width;
-    buf->fill = fill;
+static unsigned int get_stages(const struct preset *preset)
+{
+    return preset && preset->stages >= 0 ? preset->stages : stages;
+}
 
-    buf->cursor = 0;
-    buf->length = 0;
+static ssize_t preset_show(int value, char *buf)
+{
+    return sprintf(buf, "%d\n", value);
+}
 
-    buf->padding_left = -1;
+static ssize_t preset_store(int *value, int lower, const char *buf, size_t count)
+{
+    int new_value;
 
-    buf->head = kmalloc(sizeof(*buf->head), GFP_KERNEL);
-    if (unlikely(!buf->head)) {
-        return NULL;
+    if (kstrtoint(buf, 0, &new_value)) {
+        return -EINVAL;
     }
-
-    buf->tail = kmalloc(sizeof(*buf->tail), GFP_KERNEL);
-    if (unlikely(!buf->tail)) {
-        return NULL;
+    if (new_value != -1 && new_value < lower) {
+        return -EINVAL;
     }
-
-    buf->head->prev = NULL;
-    buf->head->ix = -1;
-    buf->head->next = buf->tail;
-    buf->tail->prev = buf->head;
-    buf->tail->ix = -1;
-    buf->tail->next = NULL;
-
-    return buf;
+    *value = new_value;
+    return count;
 }
 
-static void buffer_free(struct buffer *buf)
+#define PRESET_ATTR(name, lower) \
+    static ssize_t name##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+    { \
+        struct preset *preset = dev_get_drvdata(dev); \
+        return preset_show(preset->name, buf); \
+    } \
+    static ssize_t name##_store(struct device *dev, struct device_attribute *attr, \
+            const char *buf, size_t count) \
+    { \
+        struct preset *preset = dev_get_drvdata(dev); \
+        return preset_store(&preset->name, lower, buf, count); \
+    } \
+    static DEVICE_ATTR_RW(name)
+
+PRESET_ATTR(width, 0);
+PRESET_ATTR(fill, 0);
+PRESET_ATTR(buffer_size, 1);
+PRESET_ATTR(mode, 0);
+
+/* Stage chains are checked when stored, so that a bad one can't make every
+ * later open of the minor fail, and shown in hex, as they are written.
+ */
+static ssize_t stages_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-    struct newline *cur;
-    for (cur = buf->head->next; cur != NULL; cur = cur->next) {
-        kfree(cur->prev);
+    struct preset *preset = dev_get_drvdata(dev);
+    if (preset->stages < 0) {
+        return preset_show(preset->stages, buf);
     }
-    kfree(buf->tail);
-    kfree(buf->start);
-    kfree(buf);
+    return sprintf(buf, "%#x\n", preset->stages);
 }
 
-#ifdef LEFTPAD_DEBUG
-static void buffer_show(struct buffer *buf)
+static ssize_t stages_store(struct device *dev, struct device_attribute *attr,
+        const char *buf, size_t count)
 {
-    size_t i;
-    struct newline *cur;
-    char *str = kmalloc(buf->length + 1, GFP_KERNEL);
+    struct preset *preset = dev_get_drvdata(dev);
+    int new_stages;
 
-    for (i = 0; i < buf->length; i++) {
-        str[i] = buf->start[(buf->cursor + i) % buf->size];
+    if (kstrtoint(buf, 0, &new_stages)) {
+        return -EINVAL;
     }
-    str[buf->length] = 0;
-
-    printk(KERN_INFO "Showing leftpad buffer at %p:\n", buf);
-    printk(KERN_CONT "   length: %zd\n", buf->size);
-    printk(KERN_CONT "   cursor: %zd\n", buf->cursor);
-    printk(KERN_CONT "   length: %zd\n", buf->length);
-    printk(KERN_CONT "   contents: \"%s\"\n", str);
-    printk(KERN_CONT "   padding_left: %zd\n", buf->padding_left);
-    printk(KERN_CONT "   newlines:\n");
-    for (cur = buf->head->next; cur != buf->tail; cur = cur->next) {
-        printk(KERN_CONT "     +%zd\n", (cur->ix - buf->cursor) % buf->size);
+    if (new_stages != -1 && (new_stages < 0 || !stages_valid(new_stages))) {
+        return -EINVAL;
     }
-
+    preset->stages = new_stages;
+    return count;
 }
-#endif
+
+static DEVICE_ATTR_RW(stages);
+
+static struct attribute *preset_attrs[] = {
+    &dev_attr_width.attr,
+    &dev_attr_fill.attr,
+    &dev_attr_buffer_size.attr,
+    &dev_attr_mode.attr,
+    &dev_attr_stages.attr,
+    NULL
+};
+
+ATTRIBUTE_GROUPS(preset);
 
 
 /* CORE */
@@ -205,23 +215,80 @@ static struct file_operations fops = {
     .write = leftpad_write
 };
 
+static struct class *leftpad_class;
+
+static void destroy_devices(int count)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        device_destroy(leftpad_class, MKDEV(LEFTPAD_MAJOR, i));
+    }
+}
+
 static int __init leftpad_init(void)
 {
-    if (register_chrdev(LEFTPAD_MAJOR, "leftpad", &fops)) {
-        return FAILURE;
+    int i, ret;
+    struct device *dev;
+
+    if (minors < 0 || minors > 256) {
+        return -EINVAL;
+    }
+
+    presets = kmalloc_array(max(minors, 1), sizeof(*presets), GFP_KERNEL);
+    if (unlikely(!presets)) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < minors; i++) {
+        presets[i].width = -1;
+        presets[i].fill = -1;
+        presets[i].buffer_size = -1;
+        presets[i].mode = -1;
+        presets[i].stages = -1;
+    }
+
+    ret = register_chrdev(LEFTPAD_MAJOR, "leftpad", &fops);
+    if (ret) {
+        goto free_presets;
+    }
+
+    leftpad_class = class_create(THIS_MODULE, "leftpad");
+    if (IS_ERR(leftpad_class)) {
+        ret = PTR_ERR(leftpad_class);
+        goto unregister;
+    }
+
+    for (i = 0; i < minors; i++) {
+        dev = device_create_with_groups(leftpad_class, NULL, MKDEV(LEFTPAD_MAJOR, i),
+                &presets[i], preset_groups, "leftpad%d", i);
+        if (IS_ERR(dev)) {
+            ret = PTR_ERR(dev);
+            destroy_devices(i);
+            goto destroy_class;
+        }
     }
 
 #ifdef LEFTPAD_DEBUG
-    printk(KERN_INFO "Init leftpad: width=%zu, fill=ascii(%d), buffer_size=%zu\n",
-            get_width(), get_fill(), get_buffer_size());
+    printk(KERN_INFO "Init leftpad: width=%zu, fill=ascii(%d), buffer_size=%zu, mode=%d, minors=%d\n",
+            get_width(NULL), get_fill(NULL), get_buffer_size(NULL), get_mode(NULL), minors);
 #endif
 
     return SUCCESS;
+
+    destroy_class:
+        class_destroy(leftpad_class);
+    unregister:
+        unregister_chrdev(LEFTPAD_MAJOR, "leftpad");
+    free_presets:
+        kfree(presets);
+        return ret;
 }
 
 static void __exit leftpad_exit(void)
 {
+    destroy_devices(minors);
+    class_destroy(leftpad_class);
     unregister_chrdev(LEFTPAD_MAJOR, "leftpad");
+    kfree(presets);
 }
 
 
@@ -234,16 +301,28 @@ module_exit(leftpad_exit);
 
 static int leftpad_open(struct inode *inode, struct file *file)
 {
-    struct buffer *buf = buffer_alloc(get_buffer_size(), get_width(), get_fill());
+    struct preset *preset = get_preset(inode);
+    struct buffer *buf = buffer_alloc(get_buffer_size(preset), get_width(preset), get_fill(preset),
+            get_mode(preset));
+    long ret;
     if (unlikely(!buf)) {
         return -ENOMEM;
     }
+    /* A preset or the module parameters may pair deterministic mode with a
+     * chain; the chain is then left off, since the ioctl would refuse it. */
+    if (!(buf->mode & LEFTPAD_MODE_RT)) {
+        ret = buffer_ioctl(buf, IOCTL_SET_STAGES, get_stages(preset));
+        if (ret) {
+            buffer_free(buf);
+            return ret;
+        }
+    }
     file->private_data = buf;
     try_module_get(THIS_MODULE);
 
 #ifdef LEFTPAD_DEBUG
-    printk(KERN_INFO "Create leftpad buffer: width=%zu, fill=ascii(%d), buffer_size=%zu\n",
-            buf->width, buf->fill, buf->size);
+    printk(KERN_INFO "Create leftpad buffer: width=%zu, fill=ascii(%d), buffer_size=%zu, mode=%d, stages=%#x\n",
+            buf->width, buf->fill, buf->size, buf->mode, buf->stages);
 #endif
 
     return SUCCESS;
@@ -258,195 +337,85 @@ static int leftpad_release(struct inode *inode, struct file *file)
 
 static long leftpad_ioctl(struct file *file, unsigned int ioctl_num, unsigned long ioctl_param)
 {
-    int ret = SUCCESS;
+    long ret;
     struct buffer *buf = file->private_data;
 
-    if (mutex_lock_interruptible(&buf->lock)) {
+    if (rt_mutex_lock_interruptible(&buf->lock)) {
         return -ERESTARTSYS;
     }
 
-    switch (ioctl_num) {
-
-        case IOCTL_SET_WIDTH:
-            if (ioctl_param > MAX_WIDTH) {
-                ret = -EINVAL;
-                goto cleanup;
-            }
-            buf->width = ioctl_param;
-            break;
-
-        case IOCTL_SET_FILL:
-            if (ioctl_param > 256) {
-                ret = -EINVAL;
-                goto cleanup;
-            }
-            buf->fill = ioctl_param;
-            break;
-
-        default:
-            ret = -EINVAL;
-            goto cleanup;
-    }
+    ret = buffer_ioctl(buf, ioctl_num, ioctl_param);
 
-    cleanup:
-        mutex_unlock(&buf->lock);
-        return ret;
+    rt_mutex_unlock(&buf->lock);
+    return ret;
 }
 
+/* In LEFTPAD_MODE_RT, reads and writes go through a bounce buffer on the stack,
+ * copied to or from user space only while the lock isn't held. Being per call,
+ * it is never shared between concurrent readers or writers of one file.
+ */
 static ssize_t leftpad_read(struct file *file, char *buffer, size_t length, loff_t * offset)
 {
     struct buffer *buf = file->private_data;
-    size_t line_length, actual_length, chunk_len;
-    int finished_line;
-    ssize_t ret = 0;
+    char bounce[LEFTPAD_RT_CHUNK];
+    int rt = buf->mode & LEFTPAD_MODE_RT;
+    ssize_t ret;
 
-    int i;
-    ssize_t padding;
+    if (rt) {
+        length = min(length, (size_t) LEFTPAD_RT_CHUNK);
+    }
 
-    if (mutex_lock_interruptible(&buf->lock)) {
+    if (rt_mutex_lock_interruptible(&buf->lock)) {
         return -ERESTARTSYS;
     }
 
-    while (buf->head->next == buf->tail) {
-        mutex_unlock(&buf->lock);
+    while (!buffer_has_line(buf)) {
+        rt_mutex_unlock(&buf->lock);
         if (file->f_flags & O_NONBLOCK) {
             return -EAGAIN;
         }
-        if (wait_event_interruptible(buf->read_queue, buf->head->next != buf->tail)) {
+        if (wait_event_interruptible(buf->read_queue, buffer_has_line(buf))) {
             return -ERESTARTSYS;
         }
-        if (mutex_lock_interruptible(&buf->lock)) {
+        if (rt_mutex_lock_interruptible(&buf->lock)) {
             return -ERESTARTSYS;
         }
     }
 
-    line_length = (buf->head->next->ix - buf->cursor) % buf->size;
-
-    if (buf->padding_left == -1) {
-        buf->padding_left = max((ssize_t) 0, (ssize_t) buf->width - (ssize_t) line_length);
-    }
-
-    padding = min((ssize_t) length, buf->padding_left);
-    for (i = 0; i < padding; i++) {
-        if (copy_to_user(buffer + i, &(buf->fill), 1)) {
-            ret = -EFAULT;
-            goto cleanup;
-        }
-    }
-
-    if (buf->padding_left >= length) {
-
-        buf->padding_left -= length;
-        ret = length;
-        goto cleanup;
-
-    } else {
-
-        ret += buf->padding_left;
-        buffer += buf->padding_left;
-        length -= buf->padding_left;
-        buf->padding_left = 0;
-
-        if (length >= line_length + 1) {
-            actual_length = line_length + 1;
-            finished_line = 1;
-        } else {
-            actual_length = length;
-            finished_line = 0;
-        }
-
-        if (buf->cursor + actual_length > buf->size) {
-            chunk_len = buf->size - buf->cursor;
-            if (copy_to_user(buffer, buf->start + buf->cursor, chunk_len)) {
-                ret = -EFAULT;
-                goto cleanup;
-            }
-            if (copy_to_user(buffer + chunk_len, buf->start, actual_length - chunk_len)) {
-                ret = -EFAULT;
-                goto cleanup;
-            }
-        } else {
-            if (copy_to_user(buffer, buf->start + buf->cursor, actual_length)) {
-                ret = -EFAULT;
-                goto cleanup;
-            }
-        }
+    ret = buffer_read(buf, rt ? bounce : buffer, length);
 
-        if (finished_line) {
-            buf->head->next->next->prev = buf->head;
-            buf->head->next = buf->head->next->next;
-            buf->padding_left = -1;
-        }
+    rt_mutex_unlock(&buf->lock);
 
-        buf->cursor = (buf->cursor + actual_length) % buf->size;
-        buf->length -= actual_length;
-        ret += actual_length;
+    /* The bytes have already left the ring, so a fault here loses them. */
+    if (rt && ret > 0 && copy_to_user(buffer, bounce, ret)) {
+        return -EFAULT;
     }
-
-    cleanup:
-        mutex_unlock(&buf->lock);
-        return ret;
+    return ret;
 }
 
 static ssize_t leftpad_write(struct file *file, const char *buffer, size_t length, loff_t * offset)
 {
-    size_t i;
     struct buffer *buf = file->private_data;
-    size_t chunk_len;
+    char bounce[LEFTPAD_RT_CHUNK];
     ssize_t ret;
 
-    if (mutex_lock_interruptible(&buf->lock)) {
-        return -ERESTARTSYS;
-    }
-
-    if (buf->length + length > buf->size) {
-        ret = -ENOBUFS;
-        goto cleanup;
-    }
-
-    /* 3 cases (c = cursor, e = end of data, n = end of data after write):
-     *     [ c e n ]
-     *     [ n c e ]
-     *     [ e n c ]
-     */
-    if (buf->cursor + buf->length + length <= buf->size) {
-        if (copy_from_user(buf->start + buf->cursor + buf->length, buffer, length)) {
-            ret = -EFAULT;
-            goto cleanup;
-        }
-    } else if (buf->cursor + buf->length <= buf->size) {
-        chunk_len = buf->size - (buf->cursor + buf->length);
-        if (copy_from_user(buf->start + buf->cursor + buf->length, buffer, chunk_len)) {
-            ret = -EFAULT;
-            goto cleanup;
-        }
-        if (copy_from_user(buf->start, buffer + chunk_len, length - chunk_len)) {
-            ret = -EFAULT;
-            goto cleanup;
-        }
-    } else {
-        if (copy_from_user(buf->start + (buf->cursor + buf->length) % buf->size, buffer, length)) {
-            ret = -EFAULT;
-            goto cleanup;
+    if (buf->mode & LEFTPAD_MODE_RT) {
+        length = min(length, (size_t) LEFTPAD_RT_CHUNK);
+        if (copy_from_user(bounce, buffer, length)) {
+            return -EFAULT;
         }
+        buffer = bounce;
     }
 
-    for (i = 0; i < length; i++) {
-        if (buf->start[(buf->cursor + buf->length + i) % buf->size] == '\n') {
-            append_newline((buf->cursor + buf->length + i) % buf->size, buf);
-        }
+    if (rt_mutex_lock_interruptible(&buf->lock)) {
+        return -ERESTARTSYS;
     }
 
-    wake_up_interruptible(&buf->read_queue);
-
-    buf->length += length;
-    ret = length;
-
-#ifdef LEFTPAD_DEBUG
-    buffer_show(buf);
-#endif
+    ret = buffer_write(buf, buffer, length);
+    if (ret > 0) {
+        wake_up_interruptible(&buf->read_queue);
+    }
 
-    cleanup:
-        mutex_unlock(&buf->lock);
-        return ret;
+    rt_mutex_unlock(&buf->lock);
+    return ret;
 }
@@ -0,0 +1,46 @@
+#ifndef LEFTPAD_H
+#define LEFTPAD_H
+
+/* The /dev/leftpad interface, shared with user-space clients. */
+
+#ifdef __KERNEL__
+#include <linux/ioctl.h>
+#else
+#include <sys/ioctl.h>
+#endif
+
+
+#define LEFTPAD_DEVICE_NAME "leftpad"
+#define LEFTPAD_MAJOR 1337
+
+#define IOCTL_SET_WIDTH _IOR(LEFTPAD_MAJOR, 0, char *)
+#define IOCTL_SET_FILL _IOR(LEFTPAD_MAJOR, 1, char *)
+#define IOCTL_SET_STAGES _IOR(LEFTPAD_MAJOR, 2, char *)
+
+#define MAX_WIDTH 1024
+
+/* Mode flags, fixed when an instance is opened. */
+#define LEFTPAD_MODE_RT 0x1
+#define LEFTPAD_MODE_BATCH 0x2
+#define LEFTPAD_MODES (LEFTPAD_MODE_RT | LEFTPAD_MODE_BATCH)
+
+/* In LEFTPAD_MODE_RT, the most bytes a single read or write handles. */
+#define LEFTPAD_RT_CHUNK 256
+
+/* Per-line stages, applied in order as each line is read. A chain packs up to
+ * LEFTPAD_MAX_STAGES stages LEFTPAD_STAGE_BITS apiece, first stage in the
+ * lowest bits, e.g. 0x4321 = trim, expand, pad, truncate. The empty chain (0)
+ * pads only, as without stages.
+ */
+#define LEFTPAD_STAGE_TRIM 1        /* drop leading and trailing whitespace */
+#define LEFTPAD_STAGE_EXPAND 2      /* expand tabs to spaces */
+#define LEFTPAD_STAGE_PAD 3         /* pad with fill up to width */
+#define LEFTPAD_STAGE_TRUNCATE 4    /* cut to width */
+
+#define LEFTPAD_STAGE_BITS 4
+#define LEFTPAD_STAGE_MASK 0xf
+#define LEFTPAD_MAX_STAGES 8
+
+#define LEFTPAD_TAB_STOP 8
+
+#endif
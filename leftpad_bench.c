@@ -0,0 +1,399 @@
+/* Pads the same workloads through /dev/leftpad and in user space, and reports
+ * for which line lengths, widths and batch sizes the device comes out ahead.
+ *
+ * usage: leftpad-bench [-n lines] [label=device ...]
+ *
+ * Each label=device pair is benchmarked as its own column, so instances in
+ * different modes can be compared by pointing labels at minors with different
+ * presets, e.g. `default=/dev/leftpad0 rt=/dev/leftpad1`. Without any, this
+ * uses /dev/leftpad. The buffer_size of each device must hold a whole batch;
+ * workloads that don't fit are reported as "-".
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "leftpad.h"
+
+
+#define FILL ' '
+
+/* Bytes the SIMD path may read past the input or write past the output. */
+#define SLACK 16
+
+#define MAX_DEVICES 8
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+
+static const size_t line_lengths[] = { 4, 8, 16, 30, 64, 256 };
+static const size_t widths[] = { 16, 32, 64, 128 };
+static const size_t batches[] = { 1, 8, 64 };
+
+struct workload {
+    size_t line_length, width, batch;
+};
+
+static size_t output_length(const struct workload *w)
+{
+    return w->batch * ((w->line_length > w->width ? w->line_length : w->width) + 1);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/* USER SPACE */
+
+
+typedef size_t (*pad_fn)(const char *in, size_t in_len, char *out, size_t width);
+
+static size_t pad_printf(const char *in, size_t in_len, char *out, size_t width)
+{
+    const char *p, *nl, *end = in + in_len;
+    char *o = out;
+
+    for (p = in; p < end; p = nl + 1) {
+        nl = memchr(p, '\n', end - p);
+        o += sprintf(o, "%*.*s\n", (int) width, (int) (nl - p), p);
+    }
+    return o - out;
+}
+
+static size_t pad_scalar(const char *in, size_t in_len, char *out, size_t width)
+{
+    const char *p, *nl, *end = in + in_len;
+    char *o = out;
+    size_t len;
+
+    for (p = in; p < end; p = nl + 1) {
+        nl = memchr(p, '\n', end - p);
+        len = nl - p;
+        if (len < width) {
+            memset(o, FILL, width - len);
+            o += width - len;
+        }
+        memcpy(o, p, len + 1);
+        o += len + 1;
+    }
+    return o - out;
+}
+
+#ifdef __SSE2__
+static size_t pad_simd(const char *in, size_t in_len, char *out, size_t width)
+{
+    const __m128i nlv = _mm_set1_epi8('\n');
+    const __m128i fillv = _mm_set1_epi8(FILL);
+    const char *p = in, *end = in + in_len;
+    char *o = out;
+    size_t len, pad, i;
+    int mask;
+
+    while (p < end) {
+        for (len = 0; ; len += 16) {
+            mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + len)), nlv));
+            if (mask) {
+                len += __builtin_ctz(mask);
+                break;
+            }
+        }
+
+        pad = len < width ? width - len : 0;
+        for (i = 0; i < pad; i += 16) {
+            _mm_storeu_si128((__m128i *) (o + i), fillv);
+        }
+        o += pad;
+
+        for (i = 0; i <= len; i += 16) {
+            _mm_storeu_si128((__m128i *) (o + i), _mm_loadu_si128((const __m128i *) (p + i)));
+        }
+        o += len + 1;
+        p += len + 1;
+    }
+    return o - out;
+}
+#endif
+
+struct user_path {
+    const char *label;
+    pad_fn fn;
+};
+
+static const struct user_path user_paths[] = {
+    { "printf", pad_printf },
+    { "scalar", pad_scalar },
+#ifdef __SSE2__
+    { "simd", pad_simd },
+#endif
+};
+
+static volatile char sink;
+
+static double run_user(pad_fn fn, const struct workload *w, const char *in, size_t in_len,
+        char *out, size_t lines)
+{
+    size_t done;
+    double start = now_ns();
+
+    for (done = 0; done < lines; done += w->batch) {
+        fn(in, in_len, out, w->width);
+        sink ^= out[0];
+    }
+    return (now_ns() - start) / done;
+}
+
+
+/* DEVICE */
+
+
+struct device {
+    const char *label, *path;
+};
+
+static int write_all(int fd, const char *in, size_t in_len)
+{
+    size_t off;
+    ssize_t n;
+
+    for (off = 0; off < in_len; off += n) {
+        n = write(fd, in + off, in_len - off);
+        if (n < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int read_all(int fd, char *out, size_t out_len)
+{
+    size_t off;
+    ssize_t n;
+
+    for (off = 0; off < out_len; off += n) {
+        n = read(fd, out + off, out_len - off);
+        if (n <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Returns ns per line, NAN if the workload doesn't fit, or -1 on error. */
+static double run_device(const struct device *dev, const struct workload *w, const char *in,
+        size_t in_len, char *out, const char *expected, size_t lines)
+{
+    size_t done, out_len = output_length(w);
+    double start, ret;
+    int fd;
+
+    fd = open(dev->path, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", dev->path, strerror(errno));
+        return -1;
+    }
+    if (ioctl(fd, IOCTL_SET_WIDTH, w->width) || ioctl(fd, IOCTL_SET_FILL, FILL)) {
+        fprintf(stderr, "%s: ioctl: %s\n", dev->path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (write_all(fd, in, in_len)) {
+        ret = errno == ENOBUFS ? NAN : -1;
+        if (ret == -1) {
+            fprintf(stderr, "%s: write: %s\n", dev->path, strerror(errno));
+        }
+        close(fd);
+        return ret;
+    }
+    if (read_all(fd, out, out_len) || memcmp(out, expected, out_len)) {
+        fprintf(stderr, "%s: output differs from user space\n", dev->path);
+        close(fd);
+        return -1;
+    }
+
+    start = now_ns();
+    for (done = 0; done < lines; done += w->batch) {
+        if (write_all(fd, in, in_len) || read_all(fd, out, out_len)) {
+            fprintf(stderr, "%s: %s\n", dev->path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    ret = (now_ns() - start) / done;
+
+    close(fd);
+    return ret;
+}
+
+
+/* DRIVER */
+
+
+static size_t make_input(const struct workload *w, char *in)
+{
+    size_t i, j;
+    char *p = in;
+
+    for (i = 0; i < w->batch; i++) {
+        for (j = 0; j < w->line_length; j++) {
+            *p++ = 'a' + (i + j) % 26;
+        }
+        *p++ = '\n';
+    }
+    memset(p, 0, SLACK);
+    return p - in;
+}
+
+static void print_ns(double ns)
+{
+    if (isnan(ns)) {
+        printf(" %9s", "-");
+    } else {
+        printf(" %9.1f", ns);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct device devices[MAX_DEVICES];
+    size_t n_devices = 0, n_user = ARRAY_SIZE(user_paths), n_paths;
+    size_t lines = 100000;
+    size_t li, wi, bi, p, d, max_in, max_out, in_len;
+    double *results, *r, best;
+    char *in, *out, *expected, *eq;
+    struct workload w;
+    int i, opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n':
+                lines = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n lines] [label=device ...]\n", argv[0]);
+                return 1;
+        }
+    }
+    for (i = optind; i < argc; i++) {
+        eq = strchr(argv[i], '=');
+        if (!eq || n_devices == MAX_DEVICES) {
+            fprintf(stderr, "%s: expected at most %d label=device arguments\n", argv[0], MAX_DEVICES);
+            return 1;
+        }
+        *eq = 0;
+        devices[n_devices].label = argv[i];
+        devices[n_devices].path = eq + 1;
+        n_devices++;
+    }
+    if (n_devices == 0) {
+        devices[0].label = LEFTPAD_DEVICE_NAME;
+        devices[0].path = "/dev/" LEFTPAD_DEVICE_NAME;
+        n_devices = 1;
+    }
+    n_paths = n_user + n_devices;
+
+    max_in = batches[ARRAY_SIZE(batches) - 1] * (line_lengths[ARRAY_SIZE(line_lengths) - 1] + 1);
+    max_out = batches[ARRAY_SIZE(batches) - 1] * (MAX_WIDTH + line_lengths[ARRAY_SIZE(line_lengths) - 1] + 1);
+    in = malloc(max_in + SLACK);
+    out = malloc(max_out + SLACK);
+    expected = malloc(max_out + SLACK);
+    results = calloc(ARRAY_SIZE(line_lengths) * ARRAY_SIZE(widths) * ARRAY_SIZE(batches) * n_paths,
+            sizeof(*results));
+    if (!in || !out || !expected || !results) {
+        perror(argv[0]);
+        return 1;
+    }
+
+    printf("ns per line, %zu lines per workload\n\n", lines);
+    printf("%5s %5s %5s", "len", "width", "batch");
+    for (p = 0; p < n_user; p++) {
+        printf(" %9s", user_paths[p].label);
+    }
+    for (d = 0; d < n_devices; d++) {
+        printf(" %9s", devices[d].label);
+    }
+    printf("\n");
+
+    r = results;
+    for (wi = 0; wi < ARRAY_SIZE(widths); wi++) {
+        for (bi = 0; bi < ARRAY_SIZE(batches); bi++) {
+            for (li = 0; li < ARRAY_SIZE(line_lengths); li++) {
+                w.line_length = line_lengths[li];
+                w.width = widths[wi];
+                w.batch = batches[bi];
+
+                in_len = make_input(&w, in);
+                pad_scalar(in, in_len, expected, w.width);
+
+                printf("%5zu %5zu %5zu", w.line_length, w.width, w.batch);
+                for (p = 0; p < n_user; p++) {
+                    if (user_paths[p].fn(in, in_len, out, w.width) != output_length(&w)
+                            || memcmp(out, expected, output_length(&w))) {
+                        fprintf(stderr, "%s: output differs from scalar\n", user_paths[p].label);
+                        return 1;
+                    }
+                    r[p] = run_user(user_paths[p].fn, &w, in, in_len, out, lines);
+                    print_ns(r[p]);
+                }
+                for (d = 0; d < n_devices; d++) {
+                    r[n_user + d] = run_device(&devices[d], &w, in, in_len, out, expected, lines);
+                    if (r[n_user + d] < 0) {
+                        return 1;
+                    }
+                    print_ns(r[n_user + d]);
+                }
+                printf("\n");
+                fflush(stdout);
+                r += n_paths;
+            }
+        }
+    }
+
+    printf("\nshortest line length at which each device is no slower than all user-space paths\n\n");
+    printf("%5s %5s", "width", "batch");
+    for (d = 0; d < n_devices; d++) {
+        printf(" %9s", devices[d].label);
+    }
+    printf("\n");
+
+    r = results;
+    for (wi = 0; wi < ARRAY_SIZE(widths); wi++) {
+        for (bi = 0; bi < ARRAY_SIZE(batches); bi++) {
+            printf("%5zu %5zu", widths[wi], batches[bi]);
+            for (d = 0; d < n_devices; d++) {
+                for (li = 0; li < ARRAY_SIZE(line_lengths); li++) {
+                    best = INFINITY;
+                    for (p = 0; p < n_user; p++) {
+                        best = fmin(best, r[li * n_paths + p]);
+                    }
+                    if (r[li * n_paths + n_user + d] <= best) {
+                        break;
+                    }
+                }
+                if (li < ARRAY_SIZE(line_lengths)) {
+                    printf(" %9zu", line_lengths[li]);
+                } else {
+                    printf(" %9s", "never");
+                }
+            }
+            printf("\n");
+            r += ARRAY_SIZE(line_lengths) * n_paths;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,284 @@
+/* /dev/leftpad as a CUSE (character device in user space) server.
+ *
+ * Exposes the same read/write/ioctl semantics as leftpad.ko, using the same
+ * ring buffer engine, for machines where the module can't be loaded. Only
+ * read/write access to /dev/cuse is needed, not root.
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include <cuse_lowlevel.h>
+#include <fuse_opt.h>
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "leftpad_engine.h"
+
+
+/* PARAMS */
+
+
+struct params {
+    char *name;
+    unsigned major, minor;
+    int width, fill, buffer_size, mode, stages;
+};
+
+static struct params params = {
+    .name = LEFTPAD_DEVICE_NAME,
+    .major = LEFTPAD_MAJOR,
+    .minor = 0,
+    .width = 32,
+    .fill = 32,
+    .buffer_size = 1024,
+    .mode = 0,
+    .stages = 0,
+};
+
+#define PARAM(t, p) { t, offsetof(struct params, p), 1 }
+
+static const struct fuse_opt opts[] = {
+    PARAM("--name=%s", name),
+    PARAM("--maj=%u", major),
+    PARAM("--min=%u", minor),
+    PARAM("--width=%d", width),
+    PARAM("--fill=%d", fill),
+    PARAM("--buffer-size=%d", buffer_size),
+    PARAM("--mode=%d", mode),
+    PARAM("--stages=%i", stages),
+    FUSE_OPT_END
+};
+
+static size_t get_width(void)
+{
+    return params.width % MAX_WIDTH;
+}
+
+static char get_fill(void)
+{
+    return params.fill % 128;
+}
+
+static size_t get_buffer_size(void)
+{
+    return params.buffer_size;
+}
+
+static int get_mode(void)
+{
+    return params.mode & LEFTPAD_MODES;
+}
+
+static unsigned int get_stages(void)
+{
+    return params.stages;
+}
+
+
+/* IMPL */
+
+
+/* Per-open state: the ring buffer, plus room for the longest reply a single
+ * read can produce (an expanded line, see scratch_size()), so that reads don't
+ * allocate.
+ */
+struct instance {
+    struct buffer *buf;
+    char *out;
+    size_t out_size;
+};
+
+static struct instance *file_instance(struct fuse_file_info *fi)
+{
+    return (struct instance *) (uintptr_t) fi->fh;
+}
+
+static struct buffer *file_buffer(struct fuse_file_info *fi)
+{
+    return file_instance(fi)->buf;
+}
+
+static void leftpad_open(fuse_req_t req, struct fuse_file_info *fi)
+{
+    struct instance *inst;
+    long ret = -ENOMEM;
+
+    inst = malloc(sizeof(*inst));
+    if (unlikely(!inst)) {
+        goto fail;
+    }
+    inst->buf = buffer_alloc(get_buffer_size(), get_width(), get_fill(), get_mode());
+    if (unlikely(!inst->buf)) {
+        goto free_instance;
+    }
+    inst->out_size = scratch_size(inst->buf);
+    inst->out = malloc(inst->out_size);
+    if (unlikely(!inst->out)) {
+        goto free_buffer;
+    }
+    ret = buffer_ioctl(inst->buf, IOCTL_SET_STAGES, get_stages());
+    if (ret) {
+        goto free_out;
+    }
+    fi->fh = (uintptr_t) inst;
+    fuse_reply_open(req, fi);
+    return;
+
+    free_out:
+        free(inst->out);
+    free_buffer:
+        buffer_free(inst->buf);
+    free_instance:
+        free(inst);
+    fail:
+        fuse_reply_err(req, -ret);
+}
+
+static void leftpad_release(fuse_req_t req, struct fuse_file_info *fi)
+{
+    struct instance *inst = file_instance(fi);
+
+    buffer_free(inst->buf);
+    free(inst->out);
+    free(inst);
+    fuse_reply_err(req, 0);
+}
+
+static void leftpad_ioctl(fuse_req_t req, int cmd, void *arg, struct fuse_file_info *fi,
+        unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+    struct buffer *buf = file_buffer(fi);
+    long ret;
+
+    pthread_mutex_lock(&buf->lock.m);
+    ret = buffer_ioctl(buf, (unsigned int) cmd, (unsigned long) (uintptr_t) arg);
+    pthread_mutex_unlock(&buf->lock.m);
+
+    /* The argument is passed by value, so nothing is copied back even though
+     * the ioctl numbers are declared with _IOR. */
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_ioctl(req, ret, NULL, 0);
+    }
+}
+
+static void leftpad_interrupt(fuse_req_t req, void *data)
+{
+    struct buffer *buf = data;
+
+    pthread_mutex_lock(&buf->lock.m);
+    pthread_cond_broadcast(&buf->read_queue);
+    pthread_mutex_unlock(&buf->lock.m);
+}
+
+static void leftpad_read(fuse_req_t req, size_t length, off_t offset, struct fuse_file_info *fi)
+{
+    struct instance *inst = file_instance(fi);
+    struct buffer *buf = inst->buf;
+    ssize_t ret;
+
+    if (length == 0) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+
+    fuse_req_interrupt_func(req, leftpad_interrupt, buf);
+
+    pthread_mutex_lock(&buf->lock.m);
+
+    while (!buffer_has_line(buf)) {
+        if (fi->flags & O_NONBLOCK) {
+            ret = -EAGAIN;
+            goto cleanup;
+        }
+        if (fuse_req_interrupted(req)) {
+            ret = -EINTR;
+            goto cleanup;
+        }
+        pthread_cond_wait(&buf->read_queue, &buf->lock.m);
+    }
+
+    ret = buffer_read(buf, inst->out, min(length, inst->out_size));
+
+    /* Replies are sent before unlocking, as concurrent reads share out. */
+    cleanup:
+        if (ret < 0) {
+            fuse_reply_err(req, -ret);
+        } else {
+            fuse_reply_buf(req, inst->out, ret);
+        }
+        pthread_mutex_unlock(&buf->lock.m);
+}
+
+static void leftpad_write(fuse_req_t req, const char *buffer, size_t length, off_t offset,
+        struct fuse_file_info *fi)
+{
+    struct buffer *buf = file_buffer(fi);
+    ssize_t ret;
+
+    pthread_mutex_lock(&buf->lock.m);
+    ret = buffer_write(buf, buffer, length);
+    if (ret > 0) {
+        pthread_cond_broadcast(&buf->read_queue);
+    }
+    pthread_mutex_unlock(&buf->lock.m);
+
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_write(req, ret);
+    }
+}
+
+
+/* INIT */
+
+
+static const struct cuse_lowlevel_ops cuse_ops = {
+    .open = leftpad_open,
+    .release = leftpad_release,
+    .ioctl = leftpad_ioctl,
+    .read = leftpad_read,
+    .write = leftpad_write
+};
+
+int main(int argc, char **argv)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct cuse_info ci;
+    char dev_name[128];
+    const char *dev_info_argv[] = { dev_name };
+    int ret;
+
+    if (fuse_opt_parse(&args, &params, opts, NULL)) {
+        return 1;
+    }
+
+    if (params.stages < 0 || !stages_valid(params.stages)) {
+        fprintf(stderr, "%s: invalid --stages=%#x\n", argv[0], params.stages);
+        goto fail;
+    }
+    if (params.stages && (get_mode() & LEFTPAD_MODE_RT)) {
+        fprintf(stderr, "%s: --stages can't be used with deterministic --mode\n", argv[0]);
+        goto fail;
+    }
+
+    snprintf(dev_name, sizeof(dev_name), "DEVNAME=%s", params.name);
+
+    memset(&ci, 0, sizeof(ci));
+    ci.dev_major = params.major;
+    ci.dev_minor = params.minor;
+    ci.dev_info_argc = 1;
+    ci.dev_info_argv = dev_info_argv;
+
+    ret = cuse_lowlevel_main(args.argc, args.argv, &ci, &cuse_ops, NULL);
+    fuse_opt_free_args(&args);
+    return ret;
+
+    fail:
+        fuse_opt_free_args(&args);
+        return 1;
+}
@@ -0,0 +1,663 @@
+#ifndef LEFTPAD_ENGINE_H
+#define LEFTPAD_ENGINE_H
+
+/* Ring buffer engine shared by the kernel module (leftpad.c) and the CUSE
+ * server (leftpad_cuse.c). Outside the kernel, leftpad_user.h supplies
+ * stand-ins for the few kernel primitives used here.
+ *
+ * Except for buffer_alloc and buffer_free, callers must hold buf->lock.
+ * Waiting for lines and waking readers is left to the caller.
+ */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/ctype.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <linux/sched.h>
+#include <linux/rtmutex.h>
+#include <linux/string.h>
+#else
+#include "leftpad_user.h"
+#endif
+
+#include "leftpad.h"
+
+
+#define SUCCESS 0
+#define FAILURE -1
+
+/* Size of the staging area used to build batches in LEFTPAD_MODE_BATCH. */
+#define BATCH_SIZE 4096
+
+
+/* STATE */
+
+
+struct newline {
+    size_t ix;
+    struct newline *prev, *next;
+};
+
+/* lock is an rt_mutex so that a reader or writer holding it inherits the
+ * priority of any higher-priority task waiting on it.
+ *
+ * In LEFTPAD_MODE_RT, newline entries come from pool, which holds enough for
+ * a buffer full of newlines, instead of being allocated per line.
+ *
+ * In LEFTPAD_MODE_BATCH, padded lines are assembled in staging before being
+ * copied out.
+ *
+ * With stages set, each line is taken out of the ring whole and transformed in
+ * scratch, which is allocated when stages are first set. pending_left bytes of
+ * the result, starting at pending, are still to be read. Stages can't be set in
+ * LEFTPAD_MODE_RT.
+ */
+struct buffer {
+    wait_queue_head_t read_queue;
+    struct rt_mutex lock;
+
+    int mode;
+    size_t size, width;
+    char fill;
+
+    char *start;
+    size_t cursor, length;
+
+    ssize_t padding_left;
+    struct newline *head, *tail;
+    struct newline *pool, *free_newlines;
+    char *staging;
+
+    unsigned int stages;
+    char *scratch, *pending;
+    size_t pending_left;
+};
+
+static struct newline *newline_get(struct buffer *buf)
+{
+    struct newline *nl;
+
+    if (!buf->pool) {
+        return kmalloc(sizeof(*nl), GFP_KERNEL);
+    }
+    nl = buf->free_newlines;
+    if (likely(nl)) {
+        buf->free_newlines = nl->next;
+    }
+    return nl;
+}
+
+static void newline_put(struct newline *nl, struct buffer *buf)
+{
+    if (!buf->pool) {
+        kfree(nl);
+        return;
+    }
+    nl->next = buf->free_newlines;
+    buf->free_newlines = nl;
+}
+
+/* Number of bytes from index from to index to, going forward around the ring. */
+static size_t distance(struct buffer *buf, size_t from, size_t to)
+{
+    return (to + buf->size - from) % buf->size;
+}
+
+static int append_newline(size_t ix, struct buffer *buf)
+{
+    struct newline *nl = newline_get(buf);
+    if (unlikely(!nl)) {
+        return FAILURE;
+    }
+    nl->ix = ix;
+    nl->prev = buf->tail->prev;
+    nl->next = buf->tail;
+    buf->tail->prev->next = nl;
+    buf->tail->prev = nl;
+    return SUCCESS;
+}
+
+static struct buffer *buffer_alloc(size_t size, size_t width, char fill, int mode)
+{
+    size_t i;
+
+    struct buffer *buf = kmalloc(sizeof(*buf), GFP_KERNEL);
+    if (unlikely(!buf)) {
+        return NULL;
+    }
+
+    buf->start = kmalloc(size, GFP_KERNEL);
+    if (unlikely(!buf->start)) {
+        kfree(buf);
+        return NULL;
+    }
+
+    buf->pool = NULL;
+    buf->free_newlines = NULL;
+    if (mode & LEFTPAD_MODE_RT) {
+        buf->pool = vmalloc(size * sizeof(*buf->pool));
+        if (unlikely(!buf->pool)) {
+            kfree(buf->start);
+            kfree(buf);
+            return NULL;
+        }
+        for (i = 0; i < size; i++) {
+            newline_put(&buf->pool[i], buf);
+        }
+    }
+
+    buf->staging = NULL;
+    if (mode & LEFTPAD_MODE_BATCH) {
+        buf->staging = kmalloc(BATCH_SIZE, GFP_KERNEL);
+        if (unlikely(!buf->staging)) {
+            vfree(buf->pool);
+            kfree(buf->start);
+            kfree(buf);
+            return NULL;
+        }
+    }
+
+    init_waitqueue_head(&buf->read_queue);
+    rt_mutex_init(&buf->lock);
+
+    buf->mode = mode;
+    buf->size = size;
+    buf->width = width;
+    buf->fill = fill;
+
+    buf->cursor = 0;
+    buf->length = 0;
+
+    buf->padding_left = -1;
+
+    buf->stages = 0;
+    buf->scratch = NULL;
+    buf->pending = NULL;
+    buf->pending_left = 0;
+
+    buf->head = kmalloc(sizeof(*buf->head), GFP_KERNEL);
+    if (unlikely(!buf->head)) {
+        return NULL;
+    }
+
+    buf->tail = kmalloc(sizeof(*buf->tail), GFP_KERNEL);
+    if (unlikely(!buf->tail)) {
+        return NULL;
+    }
+
+    buf->head->prev = NULL;
+    buf->head->ix = -1;
+    buf->head->next = buf->tail;
+    buf->tail->prev = buf->head;
+    buf->tail->ix = -1;
+    buf->tail->next = NULL;
+
+    return buf;
+}
+
+static void buffer_free(struct buffer *buf)
+{
+    struct newline *cur, *next;
+    for (cur = buf->head->next; cur != buf->tail; cur = next) {
+        next = cur->next;
+        newline_put(cur, buf);
+    }
+    kfree(buf->head);
+    kfree(buf->tail);
+    vfree(buf->pool);
+    kfree(buf->staging);
+    vfree(buf->scratch);
+    kfree(buf->start);
+    kfree(buf);
+}
+
+#ifdef LEFTPAD_DEBUG
+static void buffer_show(struct buffer *buf)
+{
+    size_t i;
+    struct newline *cur;
+    char *str = kmalloc(buf->length + 1, GFP_KERNEL);
+
+    for (i = 0; i < buf->length; i++) {
+        str[i] = buf->start[(buf->cursor + i) % buf->size];
+    }
+    str[buf->length] = 0;
+
+    printk(KERN_INFO "Showing leftpad buffer at %p:\n", buf);
+    printk(KERN_CONT "   length: %zd\n", buf->size);
+    printk(KERN_CONT "   cursor: %zd\n", buf->cursor);
+    printk(KERN_CONT "   length: %zd\n", buf->length);
+    printk(KERN_CONT "   contents: \"%s\"\n", str);
+    printk(KERN_CONT "   padding_left: %zd\n", buf->padding_left);
+    printk(KERN_CONT "   newlines:\n");
+    for (cur = buf->head->next; cur != buf->tail; cur = cur->next) {
+        printk(KERN_CONT "     +%zd\n", distance(buf, buf->cursor, cur->ix));
+    }
+
+}
+#endif
+
+
+/* OPERATIONS */
+
+
+/* In LEFTPAD_MODE_RT, the caller moves data between user space and a bounce
+ * buffer of LEFTPAD_RT_CHUNK bytes outside the lock, so that a fault on the
+ * user buffer can't stretch the time the lock is held. buffer_read and
+ * buffer_write are then handed kernel memory, and go through these helpers
+ * rather than copy_{to,from}_user.
+ */
+static unsigned long copy_out(struct buffer *buf, char *to, const char *from, size_t n)
+{
+    if (buf->mode & LEFTPAD_MODE_RT) {
+        memcpy(to, from, n);
+        return 0;
+    }
+    return copy_to_user(to, from, n);
+}
+
+static unsigned long copy_in(struct buffer *buf, char *to, const char *from, size_t n)
+{
+    if (buf->mode & LEFTPAD_MODE_RT) {
+        memcpy(to, from, n);
+        return 0;
+    }
+    return copy_from_user(to, from, n);
+}
+
+static unsigned long fill_out(struct buffer *buf, char *to, size_t n)
+{
+    size_t i;
+
+    if (buf->mode & LEFTPAD_MODE_RT) {
+        memset(to, buf->fill, n);
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        if (copy_to_user(to + i, &(buf->fill), 1)) {
+            return n - i;
+        }
+    }
+    return 0;
+}
+
+static int buffer_has_line(struct buffer *buf)
+{
+    return buf->pending_left || buf->head->next != buf->tail;
+}
+
+/* Size of each half of scratch, plus a newline. Only EXPAND grows a line past
+ * max(its input, width), and a line with tabs in it is either from the ring or
+ * padded with a tab fill, so no longer than the ring or MAX_WIDTH; expanded,
+ * every byte can take a whole tab stop. This is several times the ring, hence
+ * vmalloc.
+ */
+static size_t scratch_size(struct buffer *buf)
+{
+    return max(buf->size, (size_t) MAX_WIDTH) * LEFTPAD_TAB_STOP + 1;
+}
+
+static int stages_valid(unsigned long stages)
+{
+    int i;
+    for (i = 0; i < LEFTPAD_MAX_STAGES; i++, stages >>= LEFTPAD_STAGE_BITS) {
+        if ((stages & LEFTPAD_STAGE_MASK) > LEFTPAD_STAGE_TRUNCATE) {
+            return 0;
+        }
+        if (!(stages & LEFTPAD_STAGE_MASK) && stages) {
+            return 0;
+        }
+    }
+    return !stages;
+}
+
+static long buffer_ioctl(struct buffer *buf, unsigned int ioctl_num, unsigned long ioctl_param)
+{
+    switch (ioctl_num) {
+
+        case IOCTL_SET_WIDTH:
+            if (ioctl_param > MAX_WIDTH) {
+                return -EINVAL;
+            }
+            buf->width = ioctl_param;
+            return SUCCESS;
+
+        case IOCTL_SET_FILL:
+            if (ioctl_param > 256) {
+                return -EINVAL;
+            }
+            buf->fill = ioctl_param;
+            return SUCCESS;
+
+        case IOCTL_SET_STAGES:
+            if (!stages_valid(ioctl_param)) {
+                return -EINVAL;
+            }
+            /* A whole line is transformed at once, which LEFTPAD_MODE_RT can't
+             * bound, and scratch would be allocated after open. */
+            if (ioctl_param && (buf->mode & LEFTPAD_MODE_RT)) {
+                return -EINVAL;
+            }
+            if (ioctl_param && !buf->scratch) {
+                buf->scratch = vmalloc(2 * scratch_size(buf));
+                if (unlikely(!buf->scratch)) {
+                    return -ENOMEM;
+                }
+            }
+            buf->stages = ioctl_param;
+            return SUCCESS;
+
+        default:
+            return -EINVAL;
+    }
+}
+
+static void pop_line(struct buffer *buf)
+{
+    struct newline *nl = buf->head->next;
+
+    nl->next->prev = buf->head;
+    buf->head->next = nl->next;
+    newline_put(nl, buf);
+}
+
+/* Emits as many whole lines no longer than width as fit in length and in
+ * staging, with a single copy to user space. Each line gets a slot of width + 1
+ * bytes; the slots are filled with the fill byte up front and each line is
+ * copied to the right end of its slot, newline included.
+ *
+ * Returns 0 if the first line doesn't qualify.
+ */
+static ssize_t buffer_read_batch(struct buffer *buf, char *buffer, size_t length)
+{
+    struct newline *nl;
+    size_t slot = buf->width + 1;
+    size_t n, i, cursor, line_length, chunk_len, consumed;
+    char *dst;
+
+    length = min(length, (size_t) BATCH_SIZE);
+
+    n = 0;
+    cursor = buf->cursor;
+    for (nl = buf->head->next; nl != buf->tail && (n + 1) * slot <= length; nl = nl->next) {
+        if (distance(buf, cursor, nl->ix) > buf->width) {
+            break;
+        }
+        cursor = (nl->ix + 1) % buf->size;
+        n++;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    memset(buf->staging, buf->fill, n * slot);
+
+    cursor = buf->cursor;
+    consumed = 0;
+    for (i = 0, nl = buf->head->next; i < n; i++, nl = nl->next) {
+        line_length = distance(buf, cursor, nl->ix) + 1;
+        dst = buf->staging + (i + 1) * slot - line_length;
+        if (cursor + line_length > buf->size) {
+            chunk_len = buf->size - cursor;
+            memcpy(dst, buf->start + cursor, chunk_len);
+            memcpy(dst + chunk_len, buf->start, line_length - chunk_len);
+        } else {
+            memcpy(dst, buf->start + cursor, line_length);
+        }
+        cursor = (cursor + line_length) % buf->size;
+        consumed += line_length;
+    }
+
+    if (copy_out(buf, buffer, buf->staging, n * slot)) {
+        return -EFAULT;
+    }
+
+    for (i = 0; i < n; i++) {
+        pop_line(buf);
+    }
+    buf->length -= consumed;
+    buf->cursor = cursor;
+
+    return n * slot;
+}
+
+/* Applies buf->stages to the n bytes at *line, which lie in one half of scratch,
+ * using the other half where a stage needs to copy. Points *line at the result
+ * and returns its length, which always leaves room for a newline.
+ */
+static size_t run_stages(struct buffer *buf, char **line, size_t n)
+{
+    size_t half = scratch_size(buf);
+    unsigned int stages;
+    char *src = *line, *dst;
+    size_t i, m;
+
+    for (stages = buf->stages; stages; stages >>= LEFTPAD_STAGE_BITS) {
+        dst = src < buf->scratch + half ? buf->scratch + half : buf->scratch;
+
+        switch (stages & LEFTPAD_STAGE_MASK) {
+
+            case LEFTPAD_STAGE_TRIM:
+                while (n && isspace((unsigned char) *src)) {
+                    src++;
+                    n--;
+                }
+                while (n && isspace((unsigned char) src[n - 1])) {
+                    n--;
+                }
+                break;
+
+            case LEFTPAD_STAGE_EXPAND:
+                for (i = 0, m = 0; i < n; i++) {
+                    if (src[i] != '\t') {
+                        dst[m++] = src[i];
+                        continue;
+                    }
+                    do {
+                        dst[m++] = ' ';
+                    } while (m % LEFTPAD_TAB_STOP);
+                }
+                src = dst;
+                n = m;
+                break;
+
+            case LEFTPAD_STAGE_PAD:
+                if (n < buf->width) {
+                    memset(dst, buf->fill, buf->width - n);
+                    memcpy(dst + buf->width - n, src, n);
+                    src = dst;
+                    n = buf->width;
+                }
+                break;
+
+            case LEFTPAD_STAGE_TRUNCATE:
+                n = min(n, buf->width);
+                break;
+        }
+    }
+
+    *line = src;
+    return n;
+}
+
+/* Takes the next line out of the ring and leaves it, transformed and with its
+ * newline, pending.
+ */
+static void stage_line(struct buffer *buf)
+{
+    size_t line_length, chunk_len;
+    char *line = buf->scratch;
+
+    line_length = distance(buf, buf->cursor, buf->head->next->ix);
+
+    if (buf->cursor + line_length > buf->size) {
+        chunk_len = buf->size - buf->cursor;
+        memcpy(line, buf->start + buf->cursor, chunk_len);
+        memcpy(line + chunk_len, buf->start, line_length - chunk_len);
+    } else {
+        memcpy(line, buf->start + buf->cursor, line_length);
+    }
+
+    buf->cursor = (buf->head->next->ix + 1) % buf->size;
+    buf->length -= line_length + 1;
+    pop_line(buf);
+
+    line_length = run_stages(buf, &line, line_length);
+    line[line_length] = '\n';
+
+    buf->pending = line;
+    buf->pending_left = line_length + 1;
+}
+
+static ssize_t buffer_read_staged(struct buffer *buf, char *buffer, size_t length)
+{
+    if (!buf->pending_left) {
+        stage_line(buf);
+    }
+
+    length = min(length, buf->pending_left);
+    if (copy_out(buf, buffer, buf->pending, length)) {
+        return -EFAULT;
+    }
+
+    buf->pending += length;
+    buf->pending_left -= length;
+    return length;
+}
+
+/* Requires buffer_has_line(buf). */
+static ssize_t buffer_read(struct buffer *buf, char *buffer, size_t length)
+{
+    size_t line_length, actual_length, chunk_len;
+    int finished_line;
+    ssize_t ret = 0;
+
+    ssize_t padding;
+
+    if (buf->mode & LEFTPAD_MODE_RT) {
+        length = min(length, (size_t) LEFTPAD_RT_CHUNK);
+    }
+
+    if (buf->pending_left || (buf->stages && buf->padding_left == -1)) {
+        return buffer_read_staged(buf, buffer, length);
+    }
+
+    if ((buf->mode & LEFTPAD_MODE_BATCH) && buf->padding_left == -1) {
+        ret = buffer_read_batch(buf, buffer, length);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    line_length = distance(buf, buf->cursor, buf->head->next->ix);
+
+    if (buf->padding_left == -1) {
+        buf->padding_left = max((ssize_t) 0, (ssize_t) buf->width - (ssize_t) line_length);
+    }
+
+    padding = min((ssize_t) length, buf->padding_left);
+    if (fill_out(buf, buffer, padding)) {
+        return -EFAULT;
+    }
+
+    if (buf->padding_left >= length) {
+
+        buf->padding_left -= length;
+        return length;
+
+    } else {
+
+        ret += buf->padding_left;
+        buffer += buf->padding_left;
+        length -= buf->padding_left;
+        buf->padding_left = 0;
+
+        if (length >= line_length + 1) {
+            actual_length = line_length + 1;
+            finished_line = 1;
+        } else {
+            actual_length = length;
+            finished_line = 0;
+        }
+
+        if (buf->cursor + actual_length > buf->size) {
+            chunk_len = buf->size - buf->cursor;
+            if (copy_out(buf, buffer, buf->start + buf->cursor, chunk_len)) {
+                return -EFAULT;
+            }
+            if (copy_out(buf, buffer + chunk_len, buf->start, actual_length - chunk_len)) {
+                return -EFAULT;
+            }
+        } else {
+            if (copy_out(buf, buffer, buf->start + buf->cursor, actual_length)) {
+                return -EFAULT;
+            }
+        }
+
+        if (finished_line) {
+            pop_line(buf);
+            buf->padding_left = -1;
+        }
+
+        buf->cursor = (buf->cursor + actual_length) % buf->size;
+        buf->length -= actual_length;
+        ret += actual_length;
+    }
+
+    return ret;
+}
+
+static ssize_t buffer_write(struct buffer *buf, const char *buffer, size_t length)
+{
+    size_t i;
+    size_t chunk_len;
+
+    if (buf->mode & LEFTPAD_MODE_RT) {
+        length = min(length, (size_t) LEFTPAD_RT_CHUNK);
+    }
+
+    if (buf->length + length > buf->size) {
+        return -ENOBUFS;
+    }
+
+    /* 3 cases (c = cursor, e = end of data, n = end of data after write):
+     *     [ c e n ]
+     *     [ n c e ]
+     *     [ e n c ]
+     */
+    if (buf->cursor + buf->length + length <= buf->size) {
+        if (copy_in(buf, buf->start + buf->cursor + buf->length, buffer, length)) {
+            return -EFAULT;
+        }
+    } else if (buf->cursor + buf->length <= buf->size) {
+        chunk_len = buf->size - (buf->cursor + buf->length);
+        if (copy_in(buf, buf->start + buf->cursor + buf->length, buffer, chunk_len)) {
+            return -EFAULT;
+        }
+        if (copy_in(buf, buf->start, buffer + chunk_len, length - chunk_len)) {
+            return -EFAULT;
+        }
+    } else {
+        if (copy_in(buf, buf->start + (buf->cursor + buf->length) % buf->size, buffer, length)) {
+            return -EFAULT;
+        }
+    }
+
+    for (i = 0; i < length; i++) {
+        if (buf->start[(buf->cursor + buf->length + i) % buf->size] == '\n') {
+            append_newline((buf->cursor + buf->length + i) % buf->size, buf);
+        }
+    }
+
+    buf->length += length;
+
+#ifdef LEFTPAD_DEBUG
+    buffer_show(buf);
+#endif
+
+    return length;
+}
+
+#endif
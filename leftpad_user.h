@@ -0,0 +1,59 @@
+#ifndef LEFTPAD_USER_H
+#define LEFTPAD_USER_H
+
+/* User-space stand-ins for the kernel primitives used by leftpad_engine.h.
+ * "User" memory is ordinary memory here, so the copy helpers never fail, and
+ * the rt_mutex is a priority-inheriting pthread mutex.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+
+#define GFP_KERNEL 0
+
+#define kmalloc(size, flags) malloc(size)
+#define kfree(ptr) free(ptr)
+
+#define vmalloc(size) malloc(size)
+#define vfree(ptr) free(ptr)
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define min(x, y) ((x) < (y) ? (x) : (y))
+#define max(x, y) ((x) > (y) ? (x) : (y))
+
+#define copy_to_user(to, from, n) (memcpy((to), (from), (n)), 0UL)
+#define copy_from_user(to, from, n) (memcpy((to), (from), (n)), 0UL)
+
+#define KERN_INFO ""
+#define KERN_CONT ""
+#define printk(...) fprintf(stderr, __VA_ARGS__)
+
+
+typedef pthread_cond_t wait_queue_head_t;
+
+struct rt_mutex {
+    pthread_mutex_t m;
+};
+
+#define init_waitqueue_head(q) pthread_cond_init((q), NULL)
+
+static inline void rt_mutex_init(struct rt_mutex *lock)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(&lock->m, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+#endif
@@ -6,7 +6,66 @@ echo 20 > /sys/module/leftpad/parameters/width
 exec 9<>/dev/leftpad
 echo bazqux >&9
 head -n 1 <&9
+echo 8 > /sys/class/leftpad/leftpad1/width
+echo 48 > /sys/class/leftpad/leftpad1/fill
+exec 11<>/dev/leftpad1
+echo 42 >&11
+head -n 1 <&11
+echo -1 > /sys/class/leftpad/leftpad1/width
+echo -1 > /sys/class/leftpad/leftpad1/fill
+echo 300 > /sys/class/leftpad/leftpad1/width
+echo 1 > /sys/class/leftpad/leftpad1/mode
+exec 15<>/dev/leftpad1
+echo x >&15
+dd bs=4096 count=1 2>/dev/null <&15 | wc -c
+dd bs=4096 count=1 2>/dev/null <&15 | wc -c
+python -c 'import os; print(os.write(15, b"y" * 300))'
+echo -1 > /sys/class/leftpad/leftpad1/width
+echo -1 > /sys/class/leftpad/leftpad1/mode
+echo 8 > /sys/class/leftpad/leftpad2/width
+echo 46 > /sys/class/leftpad/leftpad2/fill
+echo 32 > /sys/class/leftpad/leftpad2/buffer_size
+echo 2 > /sys/class/leftpad/leftpad2/mode
+exec 16<>/dev/leftpad2
+printf '%024d\n' 0 >&16
+head -n 1 <&16
+printf 'a\nbb\nccc\nlongerthanwidth\n' >&16
+dd bs=4096 count=1 2>/dev/null <&16
+dd bs=4096 count=1 2>/dev/null <&16
+echo e >&16
+dd bs=5 count=1 2>/dev/null <&16; echo
+head -n 1 <&16
+echo -1 > /sys/class/leftpad/leftpad2/width
+echo -1 > /sys/class/leftpad/leftpad2/fill
+echo -1 > /sys/class/leftpad/leftpad2/buffer_size
+echo -1 > /sys/class/leftpad/leftpad2/mode
 exec 10<>/dev/leftpad
 python -c 'import fcntl; fcntl.ioctl(10, 0x800d3900, 12); fcntl.ioctl(10, 0x800d3901, ord("_"))'
 echo xyzzy >&10
 head -n 1 <&10
+exec 12<>/dev/leftpad
+python -c 'import fcntl; fcntl.ioctl(12, 0x800d3900, 12); fcntl.ioctl(12, 0x800d3901, ord(" ")); fcntl.ioctl(12, 0x800d3902, 0x4321)'
+printf '  foo\tbar  \n' >&12
+head -n 1 <&12
+python -c 'import fcntl; fcntl.ioctl(12, 0x800d3901, ord("."))'
+printf 'ab\tc\n' >&12
+dd bs=5 count=1 2>/dev/null <&12; echo
+head -n 1 <&12
+python -c 'import fcntl
+try:
+    fcntl.ioctl(12, 0x800d3902, 0x5)
+except IOError:
+    print("rejected 0x5")'
+echo 16 > /sys/class/leftpad/leftpad3/buffer_size
+exec 13<>/dev/leftpad3
+python -c 'import fcntl; fcntl.ioctl(13, 0x800d3900, 200); fcntl.ioctl(13, 0x800d3901, ord("\t")); fcntl.ioctl(13, 0x800d3902, 0x23)'
+echo x >&13
+head -n 1 <&13 | wc -c
+echo -1 > /sys/class/leftpad/leftpad3/buffer_size
+echo 0x4321 > /sys/class/leftpad/leftpad3/stages
+cat /sys/class/leftpad/leftpad3/stages
+exec 14<>/dev/leftpad3
+printf '  foo\tbar  \n' >&14
+head -n 1 <&14
+echo 5 > /sys/class/leftpad/leftpad3/stages 2>/dev/null || echo "rejected 5"
+echo -1 > /sys/class/leftpad/leftpad3/stages